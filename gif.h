@@ -20,6 +20,7 @@
 // Create a GifWriter struct. Pass it to GifBegin() to initialize and write the header.
 // Pass subsequent frames to GifWriteFrame().
 // Finally, call GifEnd() to close the file handle and free memory.
+// Optional encoder settings are fields of GifWriter; change them after calling GifBegin().
 //
 
 #ifndef gif_h
@@ -29,11 +30,17 @@
 #include <string.h>  // for memcpy and bzero
 #include <stdint.h>  // for integer typedefs
 
+// Define GIF_THREADS to let palette building use several threads (see GifWriter::paletteTaskDepth).
+#ifdef GIF_THREADS
+#include <thread>    // for std::thread
+#endif
+
 // Define these macros to hook into a custom memory allocator.
 // TEMP_MALLOC and TEMP_FREE will only be called in stack fashion - frees in the reverse order of mallocs
 // and any temp memory allocated by a function will be freed before it exits.
 // MALLOC and FREE are used only by GifBegin and GifEnd respectively (to allocate a buffer the size of the image, which
-// is used to find changed pixels for delta-encoding.)
+// is used to find changed pixels for delta-encoding.), and by GifBeginFrame and GifEndFrame (for the LZW dictionary,
+// which has to outlive the calls in between.)
 
 #ifndef GIF_TEMP_MALLOC
 #include <stdlib.h>
@@ -77,6 +84,16 @@ int GifIMax(int l, int r) { return l>r?l:r; }
 int GifIMin(int l, int r) { return l<r?l:r; }
 int GifIAbs(int i) { return i<0?-i:i; }
 
+// A pixel counts as unchanged from the previous frame, and is left transparent, when none of its
+// channels differs from the color displayed there by more than tolerance. Since the comparison is
+// always against the displayed color, small differences can't build up over several frames.
+bool GifPixelUnchanged( const uint8_t* lastPix, const uint8_t* nextPix, int tolerance )
+{
+    return GifIAbs((int)lastPix[0] - (int)nextPix[0]) <= tolerance &&
+           GifIAbs((int)lastPix[1] - (int)nextPix[1]) <= tolerance &&
+           GifIAbs((int)lastPix[2] - (int)nextPix[2]) <= tolerance;
+}
+
 // walks the k-d tree to pick the palette entry for a desired color.
 // Takes as in/out parameters the current best color and its error -
 // only changes them if it finds a better color in its subtree.
@@ -129,6 +146,68 @@ void GifGetClosestPaletteColor(GifPalette* pPal, int r, int g, int b, int& bestI
     }
 }
 
+// Same search as GifGetClosestPaletteColor, for a bit depth known at compile time.
+// Instead of recursing, the subtrees still to be checked are kept on a small explicit stack
+// along with the distance from the color to their splitting plane. Nodes are visited
+// in the same order as the recursive version, so the result is always the same.
+template<int kBitDepth>
+void GifGetClosestPaletteColorT(const GifPalette* pPal, int r, int g, int b, int& bestInd, int& bestDiff)
+{
+    const int kFirstLeaf = 1 << kBitDepth;
+
+    // one entry per level of the tree at most
+    int stackNode[8];
+    int stackDist[8];
+    int stackSize = 0;
+
+    int node = 1;
+    for(;;)
+    {
+        if(node >= kFirstLeaf)
+        {
+            int ind = node - kFirstLeaf;
+            if(ind != kGifTransIndex)
+            {
+                int diff = GifIAbs(r - (int32_t)pPal->r[ind]) +
+                           GifIAbs(g - (int32_t)pPal->g[ind]) +
+                           GifIAbs(b - (int32_t)pPal->b[ind]);
+                if(diff < bestDiff)
+                {
+                    bestInd = ind;
+                    bestDiff = diff;
+                }
+            }
+
+            // pop subtrees until one might still contain a better color
+            do
+            {
+                if(stackSize == 0) return;
+                --stackSize;
+            } while( bestDiff <= stackDist[stackSize] );
+
+            node = stackNode[stackSize];
+            continue;
+        }
+
+        int splitElt = pPal->treeSplitElt[node];
+        int splitComp = (splitElt == 0)? r : (splitElt == 1)? g : b;
+        int splitPos = pPal->treeSplit[node];
+
+        if(splitPos > splitComp)
+        {
+            stackNode[stackSize] = node*2+1;
+            stackDist[stackSize++] = splitPos - splitComp;
+            node = node*2;
+        }
+        else
+        {
+            stackNode[stackSize] = node*2;
+            stackDist[stackSize++] = splitComp - splitPos;
+            node = node*2+1;
+        }
+    }
+}
+
 void GifSwapPixels(uint8_t* image, int pixA, int pixB)
 {
     uint8_t rA = image[pixA*4];
@@ -199,6 +278,57 @@ void GifPartitionByMedian(uint8_t* image, int left, int right, int com, int need
     }
 }
 
+// Finds the smallest and largest value of each color channel among the pixels
+void GifColorRange( const uint8_t* image, int numPixels, int* minRGB, int* maxRGB )
+{
+    int minR = 255, maxR = 0;
+    int minG = 255, maxG = 0;
+    int minB = 255, maxB = 0;
+    for(int ii=0; ii<numPixels; ++ii)
+    {
+        int r = image[ii*4+0];
+        int g = image[ii*4+1];
+        int b = image[ii*4+2];
+
+        if(r > maxR) maxR = r;
+        if(r < minR) minR = r;
+
+        if(g > maxG) maxG = g;
+        if(g < minG) minG = g;
+
+        if(b > maxB) maxB = b;
+        if(b < minB) minB = b;
+    }
+
+    minRGB[0] = minR; maxRGB[0] = maxR;
+    minRGB[1] = minG; maxRGB[1] = maxG;
+    minRGB[2] = minB; maxRGB[2] = maxB;
+}
+
+// Splits the pixels at an inner node of the k-d tree, so that each child gets its share of them,
+// and records the split in the tree. Returns the number of pixels that went to the first child.
+int GifSplitNode( uint8_t* image, int numPixels, int firstElt, int lastElt, int splitElt, int treeNode, const int* minRGB, const int* maxRGB, GifPalette* pal )
+{
+    // Find the axis with the largest range
+    int rRange = maxRGB[0] - minRGB[0];
+    int gRange = maxRGB[1] - minRGB[1];
+    int bRange = maxRGB[2] - minRGB[2];
+
+    // and split along that axis. (incidentally, this means this isn't a "proper" k-d tree but I don't know what else to call it)
+    int splitCom = 1;
+    if(bRange > gRange) splitCom = 2;
+    if(rRange > bRange && rRange > gRange) splitCom = 0;
+
+    int subPixelsA = numPixels * (splitElt - firstElt) / (lastElt - firstElt);
+
+    GifPartitionByMedian(image, 0, numPixels, splitCom, subPixelsA);
+
+    pal->treeSplitElt[treeNode] = (uint8_t)splitCom;
+    pal->treeSplit[treeNode] = image[subPixelsA*4+splitCom];
+
+    return subPixelsA;
+}
+
 // Builds a palette by creating a balanced k-d tree of all pixels in the image
 void GifSplitPalette(uint8_t* image, int numPixels, int firstElt, int lastElt, int splitElt, int splitDist, int treeNode, bool buildForDither, GifPalette* pal)
 {
@@ -274,61 +404,101 @@ void GifSplitPalette(uint8_t* image, int numPixels, int firstElt, int lastElt, i
         return;
     }
 
-    // Find the axis with the largest range
-    int minR = 255, maxR = 0;
-    int minG = 255, maxG = 0;
-    int minB = 255, maxB = 0;
-    for(int ii=0; ii<numPixels; ++ii)
-    {
-        int r = image[ii*4+0];
-        int g = image[ii*4+1];
-        int b = image[ii*4+2];
+    int minRGB[3], maxRGB[3];
+    GifColorRange(image, numPixels, minRGB, maxRGB);
 
-        if(r > maxR) maxR = r;
-        if(r < minR) minR = r;
+    int subPixelsA = GifSplitNode(image, numPixels, firstElt, lastElt, splitElt, treeNode, minRGB, maxRGB, pal);
+    int subPixelsB = numPixels-subPixelsA;
 
-        if(g > maxG) maxG = g;
-        if(g < minG) minG = g;
+    GifSplitPalette(image,              subPixelsA, firstElt, splitElt, splitElt-splitDist, splitDist/2, treeNode*2,   buildForDither, pal);
+    GifSplitPalette(image+subPixelsA*4, subPixelsB, splitElt, lastElt,  splitElt+splitDist, splitDist/2, treeNode*2+1, buildForDither, pal);
+}
 
-        if(b > maxB) maxB = b;
-        if(b < minB) minB = b;
+#ifdef GIF_THREADS
+// Below this many pixels, work isn't worth starting a thread for
+const int kGifMinTaskPixels = 1 << 14;
+const int kGifMaxTaskDepth = 4;
+const int kGifMaxTasks = 1 << kGifMaxTaskDepth;
+
+// GifColorRange, with the pixels split between up to numTasks threads
+void GifColorRangeParallel( const uint8_t* image, int numPixels, int numTasks, int* minRGB, int* maxRGB )
+{
+    numTasks = GifIMin(GifIMin(numTasks, kGifMaxTasks), numPixels / kGifMinTaskPixels);
+    if(numTasks <= 1)
+    {
+        GifColorRange(image, numPixels, minRGB, maxRGB);
+        return;
     }
 
-    int rRange = maxR - minR;
-    int gRange = maxG - minG;
-    int bRange = maxB - minB;
+    int taskMin[kGifMaxTasks][3], taskMax[kGifMaxTasks][3];
+    std::thread tasks[kGifMaxTasks];
+    for( int ii=1; ii<numTasks; ++ii )
+    {
+        int begin = (int)((int64_t)numPixels * ii / numTasks);
+        int end = (int)((int64_t)numPixels * (ii+1) / numTasks);
+        tasks[ii] = std::thread(GifColorRange, image + begin*4, end - begin, taskMin[ii], taskMax[ii]);
+    }
+    GifColorRange(image, (int)((int64_t)numPixels / numTasks), taskMin[0], taskMax[0]);
 
-    // and split along that axis. (incidentally, this means this isn't a "proper" k-d tree but I don't know what else to call it)
-    int splitCom = 1;
-    if(bRange > gRange) splitCom = 2;
-    if(rRange > bRange && rRange > gRange) splitCom = 0;
+    for( int cc=0; cc<3; ++cc )
+    {
+        minRGB[cc] = taskMin[0][cc];
+        maxRGB[cc] = taskMax[0][cc];
+    }
+    for( int ii=1; ii<numTasks; ++ii )
+    {
+        tasks[ii].join();
+        for( int cc=0; cc<3; ++cc )
+        {
+            minRGB[cc] = GifIMin(minRGB[cc], taskMin[ii][cc]);
+            maxRGB[cc] = GifIMax(maxRGB[cc], taskMax[ii][cc]);
+        }
+    }
+}
+#endif
 
-    int subPixelsA = numPixels * (splitElt - firstElt) / (lastElt - firstElt);
-    int subPixelsB = numPixels-subPixelsA;
+// Same as GifSplitPalette, but when GIF_THREADS is defined the top taskDepth levels of the tree are
+// built in parallel. The two children of a node work on separate halves of the pixels and separate
+// parts of the tree, so one of them gets a thread of its own; the color range at each of these
+// nodes is also found by several threads. The partition around the median stays serial, since
+// which of several pixels with equal values lands in which half depends on the order it visits
+// them - and the palette has to come out exactly the same as GifSplitPalette's.
+void GifSplitPaletteParallel(uint8_t* image, int numPixels, int firstElt, int lastElt, int splitElt, int splitDist, int treeNode, bool buildForDither, GifPalette* pal, int taskDepth)
+{
+#ifdef GIF_THREADS
+    if(taskDepth > 0 && lastElt > firstElt+1 && numPixels >= 2*kGifMinTaskPixels)
+    {
+        int minRGB[3], maxRGB[3];
+        // taskDepth comes straight from a public field, so keep the shift defined
+        GifColorRangeParallel(image, numPixels, 1 << GifIMin(taskDepth, kGifMaxTaskDepth), minRGB, maxRGB);
 
-    GifPartitionByMedian(image, 0, numPixels, splitCom, subPixelsA);
+        int subPixelsA = GifSplitNode(image, numPixels, firstElt, lastElt, splitElt, treeNode, minRGB, maxRGB, pal);
+        int subPixelsB = numPixels-subPixelsA;
 
-    pal->treeSplitElt[treeNode] = (uint8_t)splitCom;
-    pal->treeSplit[treeNode] = image[subPixelsA*4+splitCom];
+        std::thread firstChild(GifSplitPaletteParallel, image, subPixelsA, firstElt, splitElt, splitElt-splitDist, splitDist/2, treeNode*2, buildForDither, pal, taskDepth-1);
+        GifSplitPaletteParallel(image+subPixelsA*4, subPixelsB, splitElt, lastElt, splitElt+splitDist, splitDist/2, treeNode*2+1, buildForDither, pal, taskDepth-1);
+        firstChild.join();
+        return;
+    }
+#else
+    (void)taskDepth;
+#endif
 
-    GifSplitPalette(image,              subPixelsA, firstElt, splitElt, splitElt-splitDist, splitDist/2, treeNode*2,   buildForDither, pal);
-    GifSplitPalette(image+subPixelsA*4, subPixelsB, splitElt, lastElt,  splitElt+splitDist, splitDist/2, treeNode*2+1, buildForDither, pal);
+    GifSplitPalette(image, numPixels, firstElt, lastElt, splitElt, splitDist, treeNode, buildForDither, pal);
 }
 
 // Finds all pixels that have changed from the previous image and
 // moves them to the fromt of th buffer.
 // This allows us to build a palette optimized for the colors of the
 // changed pixels only.
-int GifPickChangedPixels( const uint8_t* lastFrame, uint8_t* frame, int numPixels )
+int GifPickChangedPixels( const uint8_t* lastFrame, uint8_t* frame, int numPixels, int tolerance = 0 )
 {
     int numChanged = 0;
     uint8_t* writeIter = frame;
 
     for (int ii=0; ii<numPixels; ++ii)
     {
-        if(lastFrame[0] != frame[0] ||
-           lastFrame[1] != frame[1] ||
-           lastFrame[2] != frame[2])
+        if(!GifPixelUnchanged(lastFrame, frame, tolerance))
         {
             writeIter[0] = frame[0];
             writeIter[1] = frame[1];
@@ -345,7 +515,8 @@ int GifPickChangedPixels( const uint8_t* lastFrame, uint8_t* frame, int numPixel
 
 // Creates a palette by placing all the image pixels in a k-d tree and then averaging the blocks at the bottom.
 // This is known as the "modified median split" technique
-void GifMakePalette( const uint8_t* lastFrame, const uint8_t* nextFrame, uint32_t width, uint32_t height, int bitDepth, bool buildForDither, GifPalette* pPal )
+// taskDepth is the number of levels of the tree built in parallel, see GifSplitPaletteParallel
+void GifMakePalette( const uint8_t* lastFrame, const uint8_t* nextFrame, uint32_t width, uint32_t height, int bitDepth, bool buildForDither, GifPalette* pPal, int tolerance = 0, int taskDepth = 0 )
 {
     pPal->bitDepth = bitDepth;
 
@@ -357,13 +528,13 @@ void GifMakePalette( const uint8_t* lastFrame, const uint8_t* nextFrame, uint32_
 
     int numPixels = (int)(width * height);
     if(lastFrame)
-        numPixels = GifPickChangedPixels(lastFrame, destroyableImage, numPixels);
+        numPixels = GifPickChangedPixels(lastFrame, destroyableImage, numPixels, tolerance);
 
     const int lastElt = 1 << bitDepth;
     const int splitElt = lastElt/2;
     const int splitDist = splitElt/2;
 
-    GifSplitPalette(destroyableImage, numPixels, 1, lastElt, splitElt, splitDist, 1, buildForDither, pPal);
+    GifSplitPaletteParallel(destroyableImage, numPixels, 1, lastElt, splitElt, splitDist, 1, buildForDither, pPal, taskDepth);
 
     GIF_TEMP_FREE(destroyableImage);
 
@@ -374,8 +545,309 @@ void GifMakePalette( const uint8_t* lastFrame, const uint8_t* nextFrame, uint32_
     pPal->r[0] = pPal->g[0] = pPal->b[0] = 0;
 }
 
+// Histogram of the changed pixels used by the incremental palette mode.
+// Colors are bucketed at 5 bits per channel; each bucket keeps the exact sum of
+// its colors so that its mean isn't biased by the bucketing.
+const int kGifHistogramBins = 1 << 15;
+
+struct GifColorBin
+{
+    uint32_t count;
+    uint64_t r, g, b;
+};
+
+// Buckets all pixels that changed from the previous image, then packs the
+// non-empty buckets at the front of the array. Returns the number of non-empty buckets.
+int GifBuildHistogram( const uint8_t* lastFrame, const uint8_t* nextFrame, uint32_t width, uint32_t height, GifColorBin* bins, int tolerance = 0 )
+{
+    memset(bins, 0, sizeof(GifColorBin)*kGifHistogramBins);
+
+    uint32_t numPixels = width*height;
+    for( uint32_t ii=0; ii<numPixels; ++ii )
+    {
+        if(!lastFrame || !GifPixelUnchanged(lastFrame, nextFrame, tolerance))
+        {
+            int bin = ((nextFrame[0] >> 3) << 10) | ((nextFrame[1] >> 3) << 5) | (nextFrame[2] >> 3);
+            bins[bin].count++;
+            bins[bin].r += nextFrame[0];
+            bins[bin].g += nextFrame[1];
+            bins[bin].b += nextFrame[2];
+        }
+
+        if(lastFrame) lastFrame += 4;
+        nextFrame += 4;
+    }
+
+    int numBins = 0;
+    for( int ii=0; ii<kGifHistogramBins; ++ii )
+    {
+        if(bins[ii].count)
+            bins[numBins++] = bins[ii];
+    }
+
+    return numBins;
+}
+
+// Average error of mapping the changed pixels to the palette, measured
+// on the bucket means and weighted by the number of pixels in each bucket
+template<int kBitDepth>
+int GifPaletteErrorT( const GifColorBin* bins, int numBins, const GifPalette* pPal )
+{
+    uint64_t error = 0, count = 0;
+    for( int ii=0; ii<numBins; ++ii )
+    {
+        const GifColorBin& bin = bins[ii];
+        int r = (int)((bin.r + bin.count/2) / bin.count);
+        int g = (int)((bin.g + bin.count/2) / bin.count);
+        int b = (int)((bin.b + bin.count/2) / bin.count);
+
+        int32_t bestDiff = 1000000;
+        int32_t bestInd = 1;
+        GifGetClosestPaletteColorT<kBitDepth>(pPal, r, g, b, bestInd, bestDiff);
+
+        error += (uint64_t)bestDiff * bin.count;
+        count += bin.count;
+    }
+
+    return count? (int)(error / count) : 0;
+}
+
+int GifPaletteError( const GifColorBin* bins, int numBins, GifPalette* pPal )
+{
+    switch(pPal->bitDepth)
+    {
+        case 1: return GifPaletteErrorT<1>(bins, numBins, pPal);
+        case 2: return GifPaletteErrorT<2>(bins, numBins, pPal);
+        case 3: return GifPaletteErrorT<3>(bins, numBins, pPal);
+        case 4: return GifPaletteErrorT<4>(bins, numBins, pPal);
+        case 5: return GifPaletteErrorT<5>(bins, numBins, pPal);
+        case 6: return GifPaletteErrorT<6>(bins, numBins, pPal);
+        case 7: return GifPaletteErrorT<7>(bins, numBins, pPal);
+        default: return GifPaletteErrorT<8>(bins, numBins, pPal);
+    }
+}
+
+// Rebuilds the k-d tree over the colors currently in the palette, so the tree search
+// stays correct after the colors have been moved. Each leaf receives exactly one of the
+// colors, though not necessarily at the same index as before.
+void GifRebuildPaletteTree( GifPalette* pPal )
+{
+    const int lastElt = 1 << pPal->bitDepth;
+    const int splitElt = lastElt/2;
+    const int splitDist = splitElt/2;
+
+    uint8_t colors[256*4];
+    for( int ii=1; ii<lastElt; ++ii )
+    {
+        colors[(ii-1)*4+0] = pPal->r[ii];
+        colors[(ii-1)*4+1] = pPal->g[ii];
+        colors[(ii-1)*4+2] = pPal->b[ii];
+        colors[(ii-1)*4+3] = 0;
+    }
+
+    GifSplitPalette(colors, lastElt-1, 1, lastElt, splitElt, splitDist, 1, false, pPal);
+
+    // same bottom node for the transparency index as GifMakePalette
+    pPal->treeSplit[1 << (pPal->bitDepth-1)] = 0;
+    pPal->treeSplitElt[1 << (pPal->bitDepth-1)] = 0;
+}
+
+// Adds each bucket's sums to those of its closest palette color
+template<int kBitDepth>
+void GifAssignBinsT( const GifColorBin* bins, int numBins, const GifPalette* pPal, uint64_t sums[256][4] )
+{
+    for( int ii=0; ii<numBins; ++ii )
+    {
+        const GifColorBin& bin = bins[ii];
+        int r = (int)((bin.r + bin.count/2) / bin.count);
+        int g = (int)((bin.g + bin.count/2) / bin.count);
+        int b = (int)((bin.b + bin.count/2) / bin.count);
+
+        int32_t bestDiff = 1000000;
+        int32_t bestInd = 1;
+        GifGetClosestPaletteColorT<kBitDepth>(pPal, r, g, b, bestInd, bestDiff);
+
+        sums[bestInd][0] += bin.r;
+        sums[bestInd][1] += bin.g;
+        sums[bestInd][2] += bin.b;
+        sums[bestInd][3] += bin.count;
+    }
+}
+
+void GifAssignBins( const GifColorBin* bins, int numBins, const GifPalette* pPal, uint64_t sums[256][4] )
+{
+    switch(pPal->bitDepth)
+    {
+        case 1: GifAssignBinsT<1>(bins, numBins, pPal, sums); break;
+        case 2: GifAssignBinsT<2>(bins, numBins, pPal, sums); break;
+        case 3: GifAssignBinsT<3>(bins, numBins, pPal, sums); break;
+        case 4: GifAssignBinsT<4>(bins, numBins, pPal, sums); break;
+        case 5: GifAssignBinsT<5>(bins, numBins, pPal, sums); break;
+        case 6: GifAssignBinsT<6>(bins, numBins, pPal, sums); break;
+        case 7: GifAssignBinsT<7>(bins, numBins, pPal, sums); break;
+        default: GifAssignBinsT<8>(bins, numBins, pPal, sums); break;
+    }
+}
+
+// Refines an existing palette with a few k-means passes over the histogram:
+// each bucket is assigned to its closest palette color, then every color moves to
+// the mean of the pixels assigned to it. Colors that attract no pixels stay put.
+void GifRefinePalette( const GifColorBin* bins, int numBins, int numPasses, GifPalette* pPal )
+{
+    const int numColors = 1 << pPal->bitDepth;
+
+    for( int pass=0; pass<numPasses && numBins>0; ++pass )
+    {
+        uint64_t sums[256][4];
+        memset(sums, 0, sizeof(sums));
+
+        GifAssignBins(bins, numBins, pPal, sums);
+
+        for( int ii=1; ii<numColors; ++ii )
+        {
+            uint64_t count = sums[ii][3];
+            if(!count) continue;
+
+            pPal->r[ii] = (uint8_t)((sums[ii][0] + count/2) / count);
+            pPal->g[ii] = (uint8_t)((sums[ii][1] + count/2) / count);
+            pPal->b[ii] = (uint8_t)((sums[ii][2] + count/2) / count);
+        }
+
+        GifRebuildPaletteTree(pPal);
+    }
+}
+
+// Open-addressed hash from 24-bit colors to palette indices, used to spot
+// frames with few enough colors to store them exactly
+const int kGifColorHashBits = 10;
+const int kGifColorHashSize = 1 << kGifColorHashBits;
+const uint32_t kGifColorHashEmpty = 0xffffffff;
+
+struct GifColorHash
+{
+    uint32_t color[kGifColorHashSize];
+    uint8_t index[kGifColorHashSize];
+};
+
+// returns the slot holding the color, or the empty slot where it belongs
+int GifColorHashFind( const GifColorHash* hash, uint32_t color )
+{
+    int slot = (int)((color * 2654435761u) >> (32 - kGifColorHashBits));
+    while(hash->color[slot] != color && hash->color[slot] != kGifColorHashEmpty)
+        slot = (slot + 1) & (kGifColorHashSize - 1);
+    return slot;
+}
+
+// Collects the distinct colors of the pixels that changed from the previous image.
+// If they fit in a palette of at most maxBitDepth bits, the palette is filled with exactly
+// those colors at the smallest sufficient bit depth, the hash maps each color to its index,
+// and the function returns true. Gives up as soon as there are too many colors.
+bool GifMakeExactPalette( const uint8_t* lastFrame, const uint8_t* nextFrame, uint32_t width, uint32_t height, int maxBitDepth, GifColorHash* hash, GifPalette* pPal, int tolerance = 0 )
+{
+    memset(hash->color, 0xff, sizeof(hash->color));
+
+    // the transparent index is reserved, so there's room for one color less than the palette size
+    const int maxColors = (1 << GifIMin(maxBitDepth, 8)) - 1;
+    int numColors = 0;
+    uint32_t prevColor = kGifColorHashEmpty;
+
+    uint32_t numPixels = width*height;
+    for( uint32_t ii=0; ii<numPixels; ++ii )
+    {
+        if(!lastFrame || !GifPixelUnchanged(lastFrame, nextFrame, tolerance))
+        {
+            uint32_t color = ((uint32_t)nextFrame[0] << 16) | ((uint32_t)nextFrame[1] << 8) | nextFrame[2];
+
+            // runs of the same color are common in the images this is meant for
+            if(color != prevColor)
+            {
+                int slot = GifColorHashFind(hash, color);
+                if(hash->color[slot] == kGifColorHashEmpty)
+                {
+                    if(numColors == maxColors) return false;
+
+                    ++numColors;
+                    hash->color[slot] = color;
+                    pPal->r[numColors] = nextFrame[0];
+                    pPal->g[numColors] = nextFrame[1];
+                    pPal->b[numColors] = nextFrame[2];
+                }
+                prevColor = color;
+            }
+        }
+
+        if(lastFrame) lastFrame += 4;
+        nextFrame += 4;
+    }
+
+    // GIF doesn't allow LZW codes of less than 2 bits, so neither do we
+    int bitDepth = 2;
+    while((1 << bitDepth) - 1 < numColors) ++bitDepth;
+    if(bitDepth > maxBitDepth) return false;
+
+    // pad the palette with copies of the last color so the tree has a color in every leaf
+    // (black, the transparent color, if nothing changed at all)
+    pPal->bitDepth = bitDepth;
+    pPal->r[0] = pPal->g[0] = pPal->b[0] = 0;
+    for( int ii=numColors+1; ii<(1 << bitDepth); ++ii )
+    {
+        pPal->r[ii] = pPal->r[numColors];
+        pPal->g[ii] = pPal->g[numColors];
+        pPal->b[ii] = pPal->b[numColors];
+    }
+
+    // building the tree moves colors around, so fill in the indices afterwards
+    GifRebuildPaletteTree(pPal);
+    for( int ii=1; ii<(1 << bitDepth); ++ii )
+    {
+        uint32_t color = ((uint32_t)pPal->r[ii] << 16) | ((uint32_t)pPal->g[ii] << 8) | pPal->b[ii];
+        hash->index[GifColorHashFind(hash, color)] = (uint8_t)ii;
+    }
+
+    return true;
+}
+
+// Palettizes an image whose colors are all in the palette from GifMakeExactPalette,
+// by looking each one up in the hash instead of searching the palette
+void GifExactImage( const uint8_t* lastFrame, const uint8_t* nextFrame, uint8_t* outFrame, uint32_t width, uint32_t height, const GifColorHash* hash, const GifPalette* pPal, int tolerance = 0 )
+{
+    uint32_t prevColor = kGifColorHashEmpty;
+    uint8_t prevInd = 0;
+
+    uint32_t numPixels = width*height;
+    for( uint32_t ii=0; ii<numPixels; ++ii )
+    {
+        if(lastFrame && GifPixelUnchanged(lastFrame, nextFrame, tolerance))
+        {
+            outFrame[0] = lastFrame[0];
+            outFrame[1] = lastFrame[1];
+            outFrame[2] = lastFrame[2];
+            outFrame[3] = kGifTransIndex;
+        }
+        else
+        {
+            uint32_t color = ((uint32_t)nextFrame[0] << 16) | ((uint32_t)nextFrame[1] << 8) | nextFrame[2];
+            if(color != prevColor)
+            {
+                prevInd = hash->index[GifColorHashFind(hash, color)];
+                prevColor = color;
+            }
+
+            outFrame[0] = pPal->r[prevInd];
+            outFrame[1] = pPal->g[prevInd];
+            outFrame[2] = pPal->b[prevInd];
+            outFrame[3] = prevInd;
+        }
+
+        if(lastFrame) lastFrame += 4;
+        outFrame += 4;
+        nextFrame += 4;
+    }
+}
+
 // Implements Floyd-Steinberg dithering, writes palette value to alpha
-void GifDitherImage( const uint8_t* lastFrame, const uint8_t* nextFrame, uint8_t* outFrame, uint32_t width, uint32_t height, GifPalette* pPal )
+template<int kBitDepth>
+void GifDitherImageT( const uint8_t* lastFrame, const uint8_t* nextFrame, uint8_t* outFrame, uint32_t width, uint32_t height, GifPalette* pPal, int tolerance )
 {
     int numPixels = (int)(width * height);
 
@@ -403,16 +875,16 @@ void GifDitherImage( const uint8_t* lastFrame, const uint8_t* nextFrame, uint8_t
             int32_t gg = (nextPix[1] + 127) / 256;
             int32_t bb = (nextPix[2] + 127) / 256;
 
-            // if it happens that we want the color from last frame, then just write out
-            // a transparent pixel
+            // if it happens that we want the color from last frame (give or take the tolerance),
+            // then just write out a transparent pixel
             if( lastFrame &&
-               lastPix[0] == rr &&
-               lastPix[1] == gg &&
-               lastPix[2] == bb )
+               GifIAbs(lastPix[0] - rr) <= tolerance &&
+               GifIAbs(lastPix[1] - gg) <= tolerance &&
+               GifIAbs(lastPix[2] - bb) <= tolerance )
             {
-                nextPix[0] = rr;
-                nextPix[1] = gg;
-                nextPix[2] = bb;
+                nextPix[0] = lastPix[0];
+                nextPix[1] = lastPix[1];
+                nextPix[2] = lastPix[2];
                 nextPix[3] = kGifTransIndex;
                 continue;
             }
@@ -421,7 +893,7 @@ void GifDitherImage( const uint8_t* lastFrame, const uint8_t* nextFrame, uint8_t
             int32_t bestInd = kGifTransIndex;
 
             // Search the palete
-            GifGetClosestPaletteColor(pPal, rr, gg, bb, bestInd, bestDiff);
+            GifGetClosestPaletteColorT<kBitDepth>(pPal, rr, gg, bb, bestInd, bestDiff);
 
             // Write the result to the temp buffer
             int32_t r_err = nextPix[0] - int32_t(pPal->r[bestInd]) * 256;
@@ -484,17 +956,15 @@ void GifDitherImage( const uint8_t* lastFrame, const uint8_t* nextFrame, uint8_t
 }
 
 // Picks palette colors for the image using simple thresholding, no dithering
-void GifThresholdImage( const uint8_t* lastFrame, const uint8_t* nextFrame, uint8_t* outFrame, uint32_t width, uint32_t height, GifPalette* pPal )
+template<int kBitDepth>
+void GifThresholdImageT( const uint8_t* lastFrame, const uint8_t* nextFrame, uint8_t* outFrame, uint32_t width, uint32_t height, GifPalette* pPal, int tolerance )
 {
     uint32_t numPixels = width*height;
     for( uint32_t ii=0; ii<numPixels; ++ii )
     {
-        // if a previous color is available, and it matches the current color,
-        // set the pixel to transparent
-        if(lastFrame &&
-           lastFrame[0] == nextFrame[0] &&
-           lastFrame[1] == nextFrame[1] &&
-           lastFrame[2] == nextFrame[2])
+        // if a previous color is available, and it matches the current color
+        // (within the tolerance), set the pixel to transparent
+        if(lastFrame && GifPixelUnchanged(lastFrame, nextFrame, tolerance))
         {
             outFrame[0] = lastFrame[0];
             outFrame[1] = lastFrame[1];
@@ -506,7 +976,7 @@ void GifThresholdImage( const uint8_t* lastFrame, const uint8_t* nextFrame, uint
             // palettize the pixel
             int32_t bestDiff = 1000000;
             int32_t bestInd = 1;
-            GifGetClosestPaletteColor(pPal, nextFrame[0], nextFrame[1], nextFrame[2], bestInd, bestDiff);
+            GifGetClosestPaletteColorT<kBitDepth>(pPal, nextFrame[0], nextFrame[1], nextFrame[2], bestInd, bestDiff);
 
             // Write the resulting color to the output buffer
             outFrame[0] = pPal->r[bestInd];
@@ -521,6 +991,37 @@ void GifThresholdImage( const uint8_t* lastFrame, const uint8_t* nextFrame, uint
     }
 }
 
+// Dispatch once per frame to the versions specialized for the palette's bit depth
+void GifDitherImage( const uint8_t* lastFrame, const uint8_t* nextFrame, uint8_t* outFrame, uint32_t width, uint32_t height, GifPalette* pPal, int tolerance = 0 )
+{
+    switch(pPal->bitDepth)
+    {
+        case 1: GifDitherImageT<1>(lastFrame, nextFrame, outFrame, width, height, pPal, tolerance); break;
+        case 2: GifDitherImageT<2>(lastFrame, nextFrame, outFrame, width, height, pPal, tolerance); break;
+        case 3: GifDitherImageT<3>(lastFrame, nextFrame, outFrame, width, height, pPal, tolerance); break;
+        case 4: GifDitherImageT<4>(lastFrame, nextFrame, outFrame, width, height, pPal, tolerance); break;
+        case 5: GifDitherImageT<5>(lastFrame, nextFrame, outFrame, width, height, pPal, tolerance); break;
+        case 6: GifDitherImageT<6>(lastFrame, nextFrame, outFrame, width, height, pPal, tolerance); break;
+        case 7: GifDitherImageT<7>(lastFrame, nextFrame, outFrame, width, height, pPal, tolerance); break;
+        default: GifDitherImageT<8>(lastFrame, nextFrame, outFrame, width, height, pPal, tolerance); break;
+    }
+}
+
+void GifThresholdImage( const uint8_t* lastFrame, const uint8_t* nextFrame, uint8_t* outFrame, uint32_t width, uint32_t height, GifPalette* pPal, int tolerance = 0 )
+{
+    switch(pPal->bitDepth)
+    {
+        case 1: GifThresholdImageT<1>(lastFrame, nextFrame, outFrame, width, height, pPal, tolerance); break;
+        case 2: GifThresholdImageT<2>(lastFrame, nextFrame, outFrame, width, height, pPal, tolerance); break;
+        case 3: GifThresholdImageT<3>(lastFrame, nextFrame, outFrame, width, height, pPal, tolerance); break;
+        case 4: GifThresholdImageT<4>(lastFrame, nextFrame, outFrame, width, height, pPal, tolerance); break;
+        case 5: GifThresholdImageT<5>(lastFrame, nextFrame, outFrame, width, height, pPal, tolerance); break;
+        case 6: GifThresholdImageT<6>(lastFrame, nextFrame, outFrame, width, height, pPal, tolerance); break;
+        case 7: GifThresholdImageT<7>(lastFrame, nextFrame, outFrame, width, height, pPal, tolerance); break;
+        default: GifThresholdImageT<8>(lastFrame, nextFrame, outFrame, width, height, pPal, tolerance); break;
+    }
+}
+
 // Simple structure to write out the LZW-compressed portion of the image
 // one bit at a time
 struct GifBitStatus
@@ -601,61 +1102,59 @@ void GifWritePalette( const GifPalette* pPal, FILE* f )
     }
 }
 
-// write the image header, LZW-compress and write out the image
-void GifWriteLzwImage(FILE* f, uint8_t* image, uint32_t left, uint32_t top,  uint32_t width, uint32_t height, uint32_t delay, GifPalette* pPal)
+// State of the LZW compressor, kept between calls so that an image
+// can be compressed a few rows at a time
+struct GifLzwStatus
 {
-    // graphics control extension
-    fputc(0x21, f);
-    fputc(0xf9, f);
-    fputc(0x04, f);
-    fputc(0x05, f); // leave prev frame in place, this frame has transparency
-    fputc(delay & 0xff, f);
-    fputc((delay >> 8) & 0xff, f);
-    fputc(kGifTransIndex, f); // transparent color index
-    fputc(0, f);
-
-    fputc(0x2c, f); // image descriptor block
-
-    fputc(left & 0xff, f);           // corner of image in canvas space
-    fputc((left >> 8) & 0xff, f);
-    fputc(top & 0xff, f);
-    fputc((top >> 8) & 0xff, f);
-
-    fputc(width & 0xff, f);          // width and height of image
-    fputc((width >> 8) & 0xff, f);
-    fputc(height & 0xff, f);
-    fputc((height >> 8) & 0xff, f);
-
-    //fputc(0, f); // no local color table, no transparency
-    //fputc(0x80, f); // no local color table, but transparency
-
-    fputc(0x80 + pPal->bitDepth-1, f); // local color table present, 2 ^ bitDepth entries
-    GifWritePalette(pPal, f);
+    GifLzwNode* codetree;  // 4096 nodes
+    int minCodeSize;
+    int32_t curCode;
+    uint32_t codeSize;
+    uint32_t maxCode;
+    GifBitStatus stat;
+};
 
-    const int minCodeSize = pPal->bitDepth;
-    const uint32_t clearCode = 1 << pPal->bitDepth;
+// starts the image data, with a fresh LZW dictionary
+void GifLzwBegin( FILE* f, GifLzwStatus& lzw, GifLzwNode* codetree, int minCodeSize )
+{
+    fputc(minCodeSize, f); // min code size
 
-    fputc(minCodeSize, f); // min code size 8 bits
+    lzw.codetree = codetree;
+    lzw.minCodeSize = minCodeSize;
+    lzw.curCode = -1;
+    lzw.codeSize = (uint32_t)minCodeSize + 1;
+    lzw.maxCode = (1u << minCodeSize) + 1;
 
-    GifLzwNode* codetree = (GifLzwNode*)GIF_TEMP_MALLOC(sizeof(GifLzwNode)*4096);
+    lzw.stat.byte = 0;
+    lzw.stat.bitIndex = 0;
+    lzw.stat.chunkIndex = 0;
 
     memset(codetree, 0, sizeof(GifLzwNode)*4096);
-    int32_t curCode = -1;
-    uint32_t codeSize = (uint32_t)minCodeSize + 1;
-    uint32_t maxCode = clearCode+1;
+    GifWriteCode(f, lzw.stat, 1u << minCodeSize, lzw.codeSize);  // start with a fresh LZW dictionary
+}
 
-    GifBitStatus stat;
-    stat.byte = 0;
-    stat.bitIndex = 0;
-    stat.chunkIndex = 0;
+// LZW-compresses the palette indices stored in the alpha channel of some rows of the image.
+// Rows start stride pixels apart, which allows compressing a rectangle of a larger image.
+// Specialized on the minimum code size (the palette's bit depth), so the clear code
+// and starting code size are compile-time constants.
+template<int kMinCodeSize>
+void GifLzwWriteRowsT( FILE* f, GifLzwStatus& lzw, const uint8_t* image, uint32_t width, uint32_t height, uint32_t stride )
+{
+    const int minCodeSize = kMinCodeSize;
+    const uint32_t clearCode = 1 << kMinCodeSize;
 
-    GifWriteCode(f, stat, clearCode, codeSize);  // start with a fresh LZW dictionary
+    GifLzwNode* codetree = lzw.codetree;
+    int32_t curCode = lzw.curCode;
+    uint32_t codeSize = lzw.codeSize;
+    uint32_t maxCode = lzw.maxCode;
+    GifBitStatus& stat = lzw.stat;
 
     for(uint32_t yy=0; yy<height; ++yy)
     {
-        for(uint32_t xx=0; xx<width; ++xx)
+        const uint8_t* pixel = image + yy*stride*4;
+        for(uint32_t xx=0; xx<width; ++xx, pixel += 4)
         {
-            uint8_t nextValue = image[(yy*width+xx)*4+3];
+            uint8_t nextValue = pixel[3];
 
             // "loser mode" - no compression, every single code is followed immediately by a clear
             //WriteCode( f, stat, nextValue, codeSize );
@@ -700,27 +1199,203 @@ void GifWriteLzwImage(FILE* f, uint8_t* image, uint32_t left, uint32_t top,  uin
         }
     }
 
+    lzw.curCode = curCode;
+    lzw.codeSize = codeSize;
+    lzw.maxCode = maxCode;
+}
+
+void GifLzwWriteRows( FILE* f, GifLzwStatus& lzw, const uint8_t* image, uint32_t width, uint32_t height, uint32_t stride )
+{
+    switch(lzw.minCodeSize)
+    {
+        case 1: GifLzwWriteRowsT<1>(f, lzw, image, width, height, stride); break;
+        case 2: GifLzwWriteRowsT<2>(f, lzw, image, width, height, stride); break;
+        case 3: GifLzwWriteRowsT<3>(f, lzw, image, width, height, stride); break;
+        case 4: GifLzwWriteRowsT<4>(f, lzw, image, width, height, stride); break;
+        case 5: GifLzwWriteRowsT<5>(f, lzw, image, width, height, stride); break;
+        case 6: GifLzwWriteRowsT<6>(f, lzw, image, width, height, stride); break;
+        case 7: GifLzwWriteRowsT<7>(f, lzw, image, width, height, stride); break;
+        default: GifLzwWriteRowsT<8>(f, lzw, image, width, height, stride); break;
+    }
+}
+
+// writes the compression footer and finishes the image data
+void GifLzwEnd( FILE* f, GifLzwStatus& lzw )
+{
+    const uint32_t clearCode = 1u << lzw.minCodeSize;
+    GifBitStatus& stat = lzw.stat;
+
     // compression footer
-    GifWriteCode(f, stat, (uint32_t)curCode, codeSize);
-    GifWriteCode(f, stat, clearCode, codeSize);
-    GifWriteCode(f, stat, clearCode + 1, (uint32_t)minCodeSize + 1);
+    GifWriteCode(f, stat, (uint32_t)lzw.curCode, lzw.codeSize);
+    GifWriteCode(f, stat, clearCode, lzw.codeSize);
+    GifWriteCode(f, stat, clearCode + 1, (uint32_t)lzw.minCodeSize + 1);
 
     // write out the last partial chunk
     while( stat.bitIndex ) GifWriteBit(stat, 0);
     if( stat.chunkIndex ) GifWriteChunk(f, stat);
 
     fputc(0, f); // image block terminator
+}
+
+// write the graphics control extension, image descriptor and palette that precede the image data
+void GifWriteImageHeader(FILE* f, uint32_t left, uint32_t top, uint32_t width, uint32_t height, uint32_t delay, const GifPalette* pPal)
+{
+    // graphics control extension
+    fputc(0x21, f);
+    fputc(0xf9, f);
+    fputc(0x04, f);
+    fputc(0x05, f); // leave prev frame in place, this frame has transparency
+    fputc(delay & 0xff, f);
+    fputc((delay >> 8) & 0xff, f);
+    fputc(kGifTransIndex, f); // transparent color index
+    fputc(0, f);
+
+    fputc(0x2c, f); // image descriptor block
+
+    fputc(left & 0xff, f);           // corner of image in canvas space
+    fputc((left >> 8) & 0xff, f);
+    fputc(top & 0xff, f);
+    fputc((top >> 8) & 0xff, f);
+
+    fputc(width & 0xff, f);          // width and height of image
+    fputc((width >> 8) & 0xff, f);
+    fputc(height & 0xff, f);
+    fputc((height >> 8) & 0xff, f);
+
+    //fputc(0, f); // no local color table, no transparency
+    //fputc(0x80, f); // no local color table, but transparency
+
+    fputc(0x80 + pPal->bitDepth-1, f); // local color table present, 2 ^ bitDepth entries
+    GifWritePalette(pPal, f);
+}
+
+// write the image header, LZW-compress and write out the image
+// stride is the distance in pixels between the starts of rows in the image, 0 if the rows are packed
+void GifWriteLzwImage(FILE* f, uint8_t* image, uint32_t left, uint32_t top,  uint32_t width, uint32_t height, uint32_t delay, GifPalette* pPal, uint32_t stride = 0)
+{
+    if(stride == 0) stride = width;
+
+    GifWriteImageHeader(f, left, top, width, height, delay, pPal);
+
+    GifLzwNode* codetree = (GifLzwNode*)GIF_TEMP_MALLOC(sizeof(GifLzwNode)*4096);
+
+    GifLzwStatus lzw;
+    GifLzwBegin(f, lzw, codetree, pPal->bitDepth);
+    GifLzwWriteRows(f, lzw, image, width, height, stride);
+    GifLzwEnd(f, lzw);
 
     GIF_TEMP_FREE(codetree);
 }
 
+// Finds the smallest rectangle holding every pixel that isn't transparent (i.e. that changed
+// from the previous frame) in a palettized image. An unchanged image yields a single
+// transparent pixel, since a frame still has to be written to carry its delay.
+void GifFindChangedRect( const uint8_t* image, uint32_t width, uint32_t height, uint32_t* left, uint32_t* top, uint32_t* rectWidth, uint32_t* rectHeight )
+{
+    uint32_t minX = width, maxX = 0;
+    uint32_t minY = height, maxY = 0;
+
+    for( uint32_t yy=0; yy<height; ++yy )
+    {
+        const uint8_t* row = image + yy*width*4;
+        for( uint32_t xx=0; xx<width; ++xx )
+        {
+            if(row[xx*4+3] != kGifTransIndex)
+            {
+                if(xx < minX) minX = xx;
+                if(xx > maxX) maxX = xx;
+                if(yy < minY) minY = yy;
+                maxY = yy;
+            }
+        }
+    }
+
+    if(minX > maxX || minY > maxY)
+    {
+        minX = maxX = 0;
+        minY = maxY = 0;
+    }
+
+    *left = minX;
+    *top = minY;
+    *rectWidth = maxX - minX + 1;
+    *rectHeight = maxY - minY + 1;
+}
+
 struct GifWriter
 {
     FILE* f;
     uint8_t* oldImage;
     bool firstFrame;
+
+    // When set, each frame after the first is cropped to the rectangle around the pixels
+    // that changed, instead of covering the whole canvas. Off by default; set after GifBegin.
+    bool cropToChanges;
+
+    // When set, frames whose changed pixels have few enough distinct colors to fit in the
+    // palette are stored losslessly: the palette holds exactly those colors, at the smallest
+    // bit depth that fits them, and neither quantization nor dithering is done. On by default.
+    bool exactPalette;
+
+    // How far, per channel, a pixel may stray from the color currently displayed and still count
+    // as unchanged (and be written as transparent). 0, the default, only skips exact matches;
+    // a few steps absorbs the noise in frames from cameras or lossy video.
+    int changeTolerance;
+
+    // Number of levels at the top of the palette's k-d tree that are built in parallel, giving
+    // up to 2^paletteTaskDepth threads. Only has an effect if GIF_THREADS is defined before
+    // including this file; the palette is the same either way. 0 (serial) by default.
+    int paletteTaskDepth;
+
+    // Incremental palette mode, off by default. Set these after GifBegin.
+    // When enabled, each frame starts from the previous frame's palette and refines it with
+    // paletteRefinePasses k-means passes over a histogram of the changed pixels, instead of
+    // building a new palette from scratch. The palette is only rebuilt once the average error
+    // has drifted more than paletteDriftThreshold above its value right after the last rebuild.
+    // Besides being cheaper, this keeps colors stable from frame to frame.
+    // (Not used when dithering, which needs the extreme colors the full build guarantees.)
+    bool incrementalPalette;
+    int paletteRefinePasses;
+    int paletteDriftThreshold;
+
+    bool havePalette;
+    int paletteBaseError;
+    GifPalette palette;  // the palette of the last frame
+
+    uint32_t canvasWidth, canvasHeight;  // the size of oldImage
+
+    // state of a frame written a few rows at a time, see GifBeginFrame
+    bool inFrame;
+    bool frameHasLast;
+    uint32_t frameRow;
+    GifLzwStatus lzw;
 };
 
+// Picks the palette for a frame in incremental palette mode, see GifWriter
+void GifUpdatePalette( GifWriter* writer, const uint8_t* lastFrame, const uint8_t* nextFrame, uint32_t width, uint32_t height, int bitDepth, GifPalette* pPal )
+{
+    GifColorBin* bins = (GifColorBin*)GIF_TEMP_MALLOC(sizeof(GifColorBin)*kGifHistogramBins);
+    int numBins = GifBuildHistogram(lastFrame, nextFrame, width, height, bins, writer->changeTolerance);
+
+    bool rebuild = !writer->havePalette || writer->palette.bitDepth != bitDepth;
+    if(!rebuild)
+    {
+        *pPal = writer->palette;
+        GifRefinePalette(bins, numBins, writer->paletteRefinePasses, pPal);
+
+        int error = GifPaletteError(bins, numBins, pPal);
+        rebuild = error > writer->paletteBaseError + writer->paletteDriftThreshold;
+    }
+
+    if(rebuild)
+    {
+        GifMakePalette(lastFrame, nextFrame, width, height, bitDepth, false, pPal, writer->changeTolerance, writer->paletteTaskDepth);
+        writer->paletteBaseError = GifPaletteError(bins, numBins, pPal);
+    }
+
+    GIF_TEMP_FREE(bins);
+}
+
 // Creates a gif file.
 // The input GIFWriter is assumed to be uninitialized.
 // The delay value is the time between frames in hundredths of a second - note that not all viewers pay much attention to this value.
@@ -736,9 +1411,22 @@ bool GifBegin( GifWriter* writer, const char* filename, uint32_t width, uint32_t
     if(!writer->f) return false;
 
     writer->firstFrame = true;
+    writer->inFrame = false;
+    writer->cropToChanges = false;
+    writer->exactPalette = true;
+    writer->changeTolerance = 0;
+    writer->paletteTaskDepth = 0;
+
+    writer->incrementalPalette = false;
+    writer->paletteRefinePasses = 2;
+    writer->paletteDriftThreshold = 3;
+    writer->havePalette = false;
+    writer->paletteBaseError = 0;
 
     // allocate
     writer->oldImage = (uint8_t*)GIF_MALLOC(width*height*4);
+    writer->canvasWidth = width;
+    writer->canvasHeight = height;
 
     fputs("GIF89a", writer->f);
 
@@ -787,20 +1475,135 @@ bool GifBegin( GifWriter* writer, const char* filename, uint32_t width, uint32_t
 // this may be handy to save bits in animations that don't change much.
 bool GifWriteFrame( GifWriter* writer, const uint8_t* image, uint32_t width, uint32_t height, uint32_t delay, int bitDepth = 8, bool dither = false )
 {
-    if(!writer->f) return false;
+    if(!writer->f || writer->inFrame) return false;
 
     const uint8_t* oldImage = writer->firstFrame? NULL : writer->oldImage;
     writer->firstFrame = false;
 
+    const int tolerance = writer->changeTolerance;
+
     GifPalette pal;
-    GifMakePalette((dither? NULL : oldImage), image, width, height, bitDepth, dither, &pal);
+    GifColorHash* hash = NULL;
+    bool exact = false;
+    if(writer->exactPalette)
+    {
+        hash = (GifColorHash*)GIF_TEMP_MALLOC(sizeof(GifColorHash));
+        exact = GifMakeExactPalette(oldImage, image, width, height, bitDepth, hash, &pal, tolerance);
+    }
+
+    if(exact)
+    {
+        GifExactImage(oldImage, image, writer->oldImage, width, height, hash, &pal, tolerance);
 
-    if(dither)
-        GifDitherImage(oldImage, image, writer->oldImage, width, height, &pal);
+        // a good starting point for the next frame in incremental palette mode
+        writer->paletteBaseError = 0;
+    }
     else
-        GifThresholdImage(oldImage, image, writer->oldImage, width, height, &pal);
+    {
+        if(writer->incrementalPalette && !dither)
+        {
+            GifUpdatePalette(writer, oldImage, image, width, height, bitDepth, &pal);
+        }
+        else
+        {
+            GifMakePalette((dither? NULL : oldImage), image, width, height, bitDepth, dither, &pal, tolerance, writer->paletteTaskDepth);
+
+            // the error baseline belonged to the palette this one replaces
+            writer->paletteBaseError = 0;
+        }
+
+        if(dither)
+            GifDitherImage(oldImage, image, writer->oldImage, width, height, &pal, tolerance);
+        else
+            GifThresholdImage(oldImage, image, writer->oldImage, width, height, &pal, tolerance);
+    }
+
+    if(hash) GIF_TEMP_FREE(hash);
+
+    writer->palette = pal;
+    writer->havePalette = true;
+
+    uint32_t left = 0, top = 0, rectWidth = width, rectHeight = height;
+    if(writer->cropToChanges && oldImage)
+        GifFindChangedRect(writer->oldImage, width, height, &left, &top, &rectWidth, &rectHeight);
+
+    GifWriteLzwImage(writer->f, writer->oldImage + ((size_t)top*width+left)*4, left, top, rectWidth, rectHeight, delay, &pal, width);
+
+    return true;
+}
+
+// Starts a frame that is passed in a few rows at a time, rather than all at once as with GifWriteFrame:
+// call GifWriteRows as rows become available, top to bottom, then GifEndFrame.
+// Each row is compared to the previous frame, palettized and compressed as soon as it arrives,
+// so encoding overlaps with producing the image and no copy of the frame is held.
+// The palette can't be built from rows that don't exist yet, so pass one in (made by GifMakePalette,
+// for instance), or NULL to reuse the palette of the previous frame.
+// Frames written this way always cover the whole canvas (width and height must match GifBegin's),
+// and aren't dithered.
+bool GifBeginFrame( GifWriter* writer, uint32_t width, uint32_t height, uint32_t delay, const GifPalette* pPal = NULL )
+{
+    if(!writer->f || writer->inFrame) return false;
+    if(!pPal && !writer->havePalette) return false;
+    if(width != writer->canvasWidth || height != writer->canvasHeight) return false;
+
+    if(pPal)
+    {
+        writer->palette = *pPal;
+        writer->paletteBaseError = 0;  // the error baseline belonged to the old palette
+    }
+    writer->havePalette = true;
+
+    writer->inFrame = true;
+    writer->frameHasLast = !writer->firstFrame;
+    writer->firstFrame = false;
+    writer->frameRow = 0;
+
+    GifWriteImageHeader(writer->f, 0, 0, width, height, delay, &writer->palette);
+
+    GifLzwNode* codetree = (GifLzwNode*)GIF_MALLOC(sizeof(GifLzwNode)*4096);
+    GifLzwBegin(writer->f, writer->lzw, codetree, writer->palette.bitDepth);
+
+    return true;
+}
+
+// Passes the next numRows rows (RGBA8, like GifWriteFrame) of a frame started by GifBeginFrame.
+bool GifWriteRows( GifWriter* writer, const uint8_t* rows, uint32_t numRows )
+{
+    if(!writer->f || !writer->inFrame) return false;
+    if(numRows > writer->canvasHeight - writer->frameRow) return false;
 
-    GifWriteLzwImage(writer->f, writer->oldImage, 0, 0, width, height, delay, &pal);
+    uint8_t* outRows = writer->oldImage + (size_t)writer->frameRow * writer->canvasWidth * 4;
+
+    GifThresholdImage(writer->frameHasLast? outRows : NULL, rows, outRows, writer->canvasWidth, numRows, &writer->palette, writer->changeTolerance);
+    GifLzwWriteRows(writer->f, writer->lzw, outRows, writer->canvasWidth, numRows, writer->canvasWidth);
+
+    writer->frameRow += numRows;
+    return true;
+}
+
+// Finishes a frame started by GifBeginFrame. Rows that were never passed in are
+// left showing the previous frame.
+bool GifEndFrame( GifWriter* writer )
+{
+    if(!writer->f || !writer->inFrame) return false;
+
+    uint32_t numRows = writer->canvasHeight - writer->frameRow;
+    uint8_t* outRows = writer->oldImage + (size_t)writer->frameRow * writer->canvasWidth * 4;
+
+    size_t numPixels = (size_t)numRows * writer->canvasWidth;
+    for( size_t ii=0; ii<numPixels; ++ii )
+    {
+        if(!writer->frameHasLast)
+            outRows[ii*4] = outRows[ii*4+1] = outRows[ii*4+2] = 0;
+        outRows[ii*4+3] = kGifTransIndex;
+    }
+    GifLzwWriteRows(writer->f, writer->lzw, outRows, writer->canvasWidth, numRows, writer->canvasWidth);
+
+    GifLzwEnd(writer->f, writer->lzw);
+    GIF_FREE(writer->lzw.codetree);
+
+    writer->lzw.codetree = NULL;
+    writer->inFrame = false;
 
     return true;
 }
@@ -812,6 +1615,8 @@ bool GifEnd( GifWriter* writer )
 {
     if(!writer->f) return false;
 
+    if(writer->inFrame) GifEndFrame(writer);
+
     fputc(0x3b, writer->f); // end of file
     fclose(writer->f);
     GIF_FREE(writer->oldImage);
@@ -0,0 +1,548 @@
+//
+// gif_read.h
+// Public domain.
+//
+// A companion to gif.h: a small streaming GIF reader in the same single-header style.
+//
+// It reads GIF87a and GIF89a files one frame at a time, including everything gif.h writes
+// (even the minimum code size of 1 it uses for 1-bit palettes, which GIF doesn't allow).
+// Memory use is bounded by the size of the canvas: the file is never loaded as a whole, frames
+// much larger than the canvas are rejected, and the LZW decoder writes each code's string
+// straight into the output using a table of string lengths and first characters, with the
+// compressed bits fetched several bytes at a time.
+//
+// USAGE:
+// Create a GifReader struct. Pass it to GifReadBegin() to open a file and read its header.
+// Call GifReadFrame() to composite each frame in turn onto an RGBA canvas of the image's
+// width*height pixels, which is kept between calls (start it out zeroed). It returns false
+// after the last frame, and also if the file turns out to be damaged (truncated, corrupt LZW
+// data, a frame far larger than the canvas...) or memory runs out: reader->error is set in
+// that case, and stays set, so every later call returns false as well.
+// Or, to get at the palette indices, call GifReadFrameInfo() followed by GifReadFrameIndices().
+// Finally, call GifReadEnd() to close the file handle and free memory.
+//
+
+#ifndef gif_read_h
+#define gif_read_h
+
+#include <stdio.h>   // for FILE*
+#include <string.h>  // for memcpy and memset
+#include <stdint.h>  // for integer typedefs
+
+// Same memory hooks as gif.h.
+// GIF_TEMP_MALLOC/GIF_TEMP_FREE hold one frame's indices during GifReadFrame.
+// GIF_MALLOC/GIF_FREE hold the decoder tables, and a copy of the canvas if a frame
+// asks for it to be restored afterwards; everything is freed by GifReadEnd.
+
+#ifndef GIF_TEMP_MALLOC
+#include <stdlib.h>
+#define GIF_TEMP_MALLOC malloc
+#endif
+
+#ifndef GIF_TEMP_FREE
+#include <stdlib.h>
+#define GIF_TEMP_FREE free
+#endif
+
+#ifndef GIF_MALLOC
+#include <stdlib.h>
+#define GIF_MALLOC malloc
+#endif
+
+#ifndef GIF_FREE
+#include <stdlib.h>
+#define GIF_FREE free
+#endif
+
+// A frame may cover at most this many times the canvas area
+const uint64_t kGifReadMaxFrameScale = 4;
+
+// Everything known about a frame before its pixels are decoded
+struct GifFrameInfo
+{
+    uint32_t left, top;      // corner of the frame in canvas space
+    uint32_t width, height;  // may extend past the canvas in broken files
+    uint32_t delay;          // hundredths of a second
+    int disposal;            // 0-1: leave in place, 2: clear to transparent, 3: restore what was there before
+    int transIndex;          // transparent palette index, -1 if none
+    bool interlaced;
+
+    int bitDepth;            // the color table has 2^bitDepth entries
+    uint8_t palette[256*3];  // the local color table, or else the global one
+};
+
+// The LZW string table. Instead of a stack, every code knows its length and first
+// character, so its string can be written out back to front right where it belongs.
+struct GifLzwTable
+{
+    uint16_t prefix[4096];
+    uint16_t length[4096];
+    uint8_t suffix[4096];
+    uint8_t first[4096];
+};
+
+struct GifReader
+{
+    FILE* f;
+    uint32_t width, height;  // canvas size
+    int loopCount;           // from the NETSCAPE2.0 extension: 0 loops forever, -1 if there is none
+
+    int globalBitDepth;      // 0 if there is no global color table
+    uint8_t globalPalette[256*3];
+
+    GifLzwTable* table;
+
+    // the current data sub-block
+    uint8_t block[256];
+    int blockSize, blockPos;
+    bool blocksEnded;
+
+    // the frame whose info has been read, but not its pixels yet
+    GifFrameInfo frame;
+    bool framePending;
+
+    // how to clean up after the last frame passed to GifReadFrame
+    int lastDisposal;
+    uint32_t lastLeft, lastTop, lastWidth, lastHeight;
+    uint8_t* savedCanvas;
+
+    // set when a call failed because of a damaged file or a failed allocation,
+    // rather than because the last frame had been read
+    bool error;
+};
+
+uint32_t GifReadMin( uint32_t l, uint32_t r ) { return l<r?l:r; }
+
+// notes that the file can't be read any further
+bool GifReadFail( GifReader* reader )
+{
+    reader->error = true;
+    return false;
+}
+
+int GifReadShort( FILE* f )
+{
+    int lo = fgetc(f);
+    int hi = fgetc(f);
+    if(lo == EOF || hi == EOF) return -1;
+    return lo | (hi << 8);
+}
+
+bool GifReadColorTable( FILE* f, int bitDepth, uint8_t* palette )
+{
+    size_t size = (size_t)3 << bitDepth;
+    return fread(palette, 1, size, f) == size;
+}
+
+// Loads the next data sub-block. Returns false, and notes it, at the zero-length block terminator.
+bool GifReadSubBlock( GifReader* reader )
+{
+    reader->blockPos = 0;
+    reader->blockSize = 0;
+    if(reader->blocksEnded) return false;
+
+    int size = fgetc(reader->f);
+    if(size == EOF || size == 0 || fread(reader->block, 1, (size_t)size, reader->f) != (size_t)size)
+    {
+        reader->blocksEnded = true;
+        return false;
+    }
+
+    reader->blockSize = size;
+    return true;
+}
+
+// Skips the rest of a chain of sub-blocks, up to and including the terminator
+void GifSkipSubBlocks( GifReader* reader )
+{
+    while(GifReadSubBlock(reader)) {}
+}
+
+// Opens a gif file and reads its header.
+// The input GifReader is assumed to be uninitialized.
+bool GifReadBegin( GifReader* reader, const char* filename )
+{
+    memset(reader, 0, sizeof(GifReader));
+    reader->loopCount = -1;
+
+#if defined(_MSC_VER) && (_MSC_VER >= 1400)
+    fopen_s(&reader->f, filename, "rb");
+#else
+    reader->f = fopen(filename, "rb");
+#endif
+    if(!reader->f) return false;
+
+    uint8_t header[13];
+    if(fread(header, 1, 13, reader->f) != 13 ||
+       (memcmp(header, "GIF87a", 6) && memcmp(header, "GIF89a", 6)))
+    {
+        fclose(reader->f);
+        reader->f = NULL;
+        return false;
+    }
+
+    reader->width = (uint32_t)(header[6] | (header[7] << 8));
+    reader->height = (uint32_t)(header[8] | (header[9] << 8));
+
+    if(header[10] & 0x80)
+    {
+        reader->globalBitDepth = (header[10] & 7) + 1;
+        if(!GifReadColorTable(reader->f, reader->globalBitDepth, reader->globalPalette))
+        {
+            fclose(reader->f);
+            reader->f = NULL;
+            return false;
+        }
+    }
+
+    reader->table = (GifLzwTable*)GIF_MALLOC(sizeof(GifLzwTable));
+    if(!reader->table)
+    {
+        fclose(reader->f);
+        reader->f = NULL;
+        return false;
+    }
+
+    return true;
+}
+
+// Reads up to and including the next image descriptor and its color table, handling any
+// extensions on the way. Returns false at the end of the file or on an error (see GifReader::error).
+// Must be followed by GifReadFrameIndices (or GifReadFrame) before reading on.
+bool GifReadFrameInfo( GifReader* reader, GifFrameInfo* info )
+{
+    if(!reader->f || reader->error) return false;
+    if(reader->framePending)
+    {
+        *info = reader->frame;
+        return true;
+    }
+
+    FILE* f = reader->f;
+    GifFrameInfo& frame = reader->frame;
+    frame.delay = 0;
+    frame.disposal = 0;
+    frame.transIndex = -1;
+
+    for(;;)
+    {
+        int block = fgetc(f);
+        if(block == 0x3b)
+        {
+            // end of file; leave the trailer to be found again by any later call
+            ungetc(block, f);
+            return false;
+        }
+        if(block == EOF) return GifReadFail(reader);  // truncated, there should have been a trailer
+
+        if(block == 0x21)
+        {
+            int label = fgetc(f);
+            reader->blocksEnded = false;
+
+            if(label == 0xf9 && GifReadSubBlock(reader) && reader->blockSize >= 4)
+            {
+                // graphics control extension
+                frame.disposal = (reader->block[0] >> 2) & 7;
+                frame.delay = (uint32_t)(reader->block[1] | (reader->block[2] << 8));
+                if(reader->block[0] & 1) frame.transIndex = reader->block[3];
+            }
+            else if(label == 0xff && GifReadSubBlock(reader) &&
+                    reader->blockSize == 11 && !memcmp(reader->block, "NETSCAPE2.0", 11) &&
+                    GifReadSubBlock(reader) && reader->blockSize >= 3 && reader->block[0] == 1)
+            {
+                reader->loopCount = reader->block[1] | (reader->block[2] << 8);
+            }
+
+            GifSkipSubBlocks(reader);
+            continue;
+        }
+
+        if(block != 0x2c) return GifReadFail(reader);
+
+        // image descriptor
+        int left = GifReadShort(f);
+        int top = GifReadShort(f);
+        int width = GifReadShort(f);
+        int height = GifReadShort(f);
+        int flags = fgetc(f);
+        if(left < 0 || top < 0 || width < 0 || height < 0 || flags == EOF) return GifReadFail(reader);
+
+        // frames may stick out of the canvas a little in broken files, but not allocate gigabytes
+        if((uint64_t)width * (uint64_t)height > kGifReadMaxFrameScale * reader->width * reader->height)
+            return GifReadFail(reader);
+
+        frame.left = (uint32_t)left;
+        frame.top = (uint32_t)top;
+        frame.width = (uint32_t)width;
+        frame.height = (uint32_t)height;
+        frame.interlaced = (flags & 0x40) != 0;
+
+        if(flags & 0x80)
+        {
+            frame.bitDepth = (flags & 7) + 1;
+            if(!GifReadColorTable(f, frame.bitDepth, frame.palette)) return GifReadFail(reader);
+        }
+        else
+        {
+            frame.bitDepth = reader->globalBitDepth;
+            memcpy(frame.palette, reader->globalPalette, (size_t)3 << reader->globalBitDepth);
+        }
+
+        reader->framePending = true;
+        *info = frame;
+        return true;
+    }
+}
+
+// LZW-decodes image data into numPixels indices, in the order they are stored.
+// Returns false if the data is corrupt or runs out early.
+bool GifReadLzw( GifReader* reader, int minCodeSize, uint8_t* out, uint32_t numPixels )
+{
+    if(minCodeSize < 1 || minCodeSize > 8) return false;
+
+    GifLzwTable* table = reader->table;
+    const uint32_t clearCode = 1u << minCodeSize;
+    uint32_t codeSize = (uint32_t)minCodeSize + 1;
+    uint32_t nextCode = clearCode + 2;
+    int32_t prevCode = -1;
+
+    // the single-character strings (a frame with a smaller code size may have overwritten some)
+    for(uint32_t ii=0; ii<clearCode; ++ii)
+    {
+        table->prefix[ii] = 0;
+        table->length[ii] = 1;
+        table->suffix[ii] = (uint8_t)ii;
+        table->first[ii] = (uint8_t)ii;
+    }
+
+    uint64_t bits = 0;
+    uint32_t numBits = 0;
+    uint32_t written = 0;
+
+    while(written < numPixels)
+    {
+        if(numBits < codeSize)
+        {
+            // top up the bit buffer with as many bytes as it can take
+            while(numBits <= 56)
+            {
+                if(reader->blockPos == reader->blockSize && !GifReadSubBlock(reader))
+                    break;
+
+                uint32_t count = GifReadMin((56 - numBits) / 8 + 1, (uint32_t)(reader->blockSize - reader->blockPos));
+                for(uint32_t ii=0; ii<count; ++ii)
+                {
+                    bits |= (uint64_t)reader->block[reader->blockPos++] << numBits;
+                    numBits += 8;
+                }
+            }
+            if(numBits < codeSize) break;  // out of data
+        }
+
+        uint32_t code = (uint32_t)bits & ((1u << codeSize) - 1);
+        bits >>= codeSize;
+        numBits -= codeSize;
+
+        if(code == clearCode)
+        {
+            codeSize = (uint32_t)minCodeSize + 1;
+            nextCode = clearCode + 2;
+            prevCode = -1;
+            continue;
+        }
+        if(code == clearCode + 1) break;  // end of information
+
+        if(prevCode < 0)
+        {
+            if(code > clearCode) return false;
+            out[written++] = (uint8_t)code;
+            prevCode = (int32_t)code;
+
+            // with a minimum code size of 1 (only written by gif.h) the table starts out full,
+            // and gif.h's encoder has already gone up a bit by its next code
+            if(nextCode == (1u << codeSize) && codeSize < 12)
+                ++codeSize;
+            continue;
+        }
+
+        // a code one past the end of the table stands for the previous string plus its own first character
+        uint32_t stringCode = code;
+        uint32_t length;
+        uint8_t firstChar;
+        if(code < nextCode)
+        {
+            length = table->length[code];
+            firstChar = table->first[code];
+        }
+        else if(code == nextCode)
+        {
+            stringCode = (uint32_t)prevCode;
+            length = table->length[prevCode] + 1u;
+            firstChar = table->first[prevCode];
+        }
+        else
+        {
+            return false;
+        }
+
+        // write the string back to front, dropping whatever would run off the end of the image
+        uint32_t end = written + length;
+        uint32_t pos = end;
+        if(code == nextCode)
+        {
+            if(--pos < numPixels) out[pos] = firstChar;
+        }
+        while(pos > written)
+        {
+            if(--pos < numPixels) out[pos] = table->suffix[stringCode];
+            stringCode = table->prefix[stringCode];
+        }
+        written = GifReadMin(end, numPixels);
+
+        if(nextCode < 4096)
+        {
+            table->prefix[nextCode] = (uint16_t)prevCode;
+            table->suffix[nextCode] = firstChar;
+            table->first[nextCode] = table->first[prevCode];
+            table->length[nextCode] = (uint16_t)(table->length[prevCode] + 1);
+            ++nextCode;
+
+            if(nextCode == (1u << codeSize) && codeSize < 12)
+                ++codeSize;
+        }
+
+        prevCode = (int32_t)code;
+    }
+
+    return written == numPixels;
+}
+
+// Decodes the pixels of the frame whose info was just read into info->width*info->height
+// palette indices, top row first (interlaced frames are put back in order).
+bool GifReadFrameIndices( GifReader* reader, const GifFrameInfo* info, uint8_t* indices )
+{
+    if(!reader->f || reader->error || !reader->framePending) return false;
+    reader->framePending = false;
+
+    int minCodeSize = fgetc(reader->f);
+    if(minCodeSize == EOF) return GifReadFail(reader);
+
+    reader->blocksEnded = false;
+    reader->blockPos = reader->blockSize = 0;
+
+    uint32_t numPixels = info->width * info->height;
+    bool ok = GifReadLzw(reader, minCodeSize, indices, numPixels);
+    GifSkipSubBlocks(reader);
+    if(!ok) return GifReadFail(reader);
+
+    if(info->interlaced && info->height > 1)
+    {
+        // rows are stored in four passes: every 8th row from 0, every 8th from 4, every 4th from 2, every 2nd from 1
+        uint8_t* stored = (uint8_t*)GIF_TEMP_MALLOC(numPixels);
+        if(!stored) return GifReadFail(reader);
+        memcpy(stored, indices, numPixels);
+
+        static const uint32_t passStart[4] = { 0, 4, 2, 1 };
+        static const uint32_t passStep[4] = { 8, 8, 4, 2 };
+
+        const uint8_t* row = stored;
+        for(int pass=0; pass<4; ++pass)
+        {
+            for(uint32_t yy=passStart[pass]; yy<info->height; yy+=passStep[pass])
+            {
+                memcpy(indices + yy*info->width, row, info->width);
+                row += info->width;
+            }
+        }
+
+        GIF_TEMP_FREE(stored);
+    }
+
+    return true;
+}
+
+// Draws the next frame onto an RGBA canvas of width*height pixels, after clearing up the previous
+// frame as its disposal method asks. The canvas must be kept between calls, and should start out zeroed.
+// Returns false after the last frame, or on an error (see GifReader::error).
+bool GifReadFrame( GifReader* reader, uint8_t* canvas, GifFrameInfo* info )
+{
+    if(!GifReadFrameInfo(reader, info)) return false;
+
+    const uint32_t width = reader->width, height = reader->height;
+
+    if(reader->lastDisposal == 2)
+    {
+        for(uint32_t yy=reader->lastTop; yy<reader->lastTop+reader->lastHeight && yy<height; ++yy)
+        {
+            uint32_t xx = reader->lastLeft;
+            if(xx >= width) break;
+            uint32_t count = GifReadMin(reader->lastWidth, width - xx);
+            memset(canvas + ((size_t)yy*width + xx)*4, 0, (size_t)count*4);
+        }
+    }
+    else if(reader->lastDisposal == 3 && reader->savedCanvas)
+    {
+        memcpy(canvas, reader->savedCanvas, (size_t)width*height*4);
+    }
+
+    if(info->disposal == 3)
+    {
+        if(!reader->savedCanvas)
+            reader->savedCanvas = (uint8_t*)GIF_MALLOC((size_t)width*height*4);
+        if(!reader->savedCanvas) return GifReadFail(reader);
+        memcpy(reader->savedCanvas, canvas, (size_t)width*height*4);
+    }
+
+    reader->lastDisposal = info->disposal;
+    reader->lastLeft = info->left;
+    reader->lastTop = info->top;
+    reader->lastWidth = info->width;
+    reader->lastHeight = info->height;
+
+    size_t numPixels = (size_t)info->width * info->height;
+    uint8_t* indices = (uint8_t*)GIF_TEMP_MALLOC(numPixels? numPixels : 1);
+    if(!indices) return GifReadFail(reader);
+    bool ok = GifReadFrameIndices(reader, info, indices);
+
+    if(ok)
+    {
+        for(uint32_t yy=0; yy<info->height && info->top+yy<height; ++yy)
+        {
+            const uint8_t* src = indices + (size_t)yy*info->width;
+            uint8_t* dst = canvas + ((size_t)(info->top+yy)*width + info->left)*4;
+
+            for(uint32_t xx=0; xx<info->width && info->left+xx<width; ++xx, dst += 4)
+            {
+                int ind = src[xx];
+                if(ind == info->transIndex) continue;
+
+                dst[0] = info->palette[ind*3+0];
+                dst[1] = info->palette[ind*3+1];
+                dst[2] = info->palette[ind*3+2];
+                dst[3] = 255;
+            }
+        }
+    }
+
+    GIF_TEMP_FREE(indices);
+    return ok;
+}
+
+// Closes the file handle and frees the memory used by a GifReader.
+bool GifReadEnd( GifReader* reader )
+{
+    if(!reader->f) return false;
+
+    fclose(reader->f);
+    GIF_FREE(reader->table);
+    if(reader->savedCanvas) GIF_FREE(reader->savedCanvas);
+
+    reader->f = NULL;
+    reader->table = NULL;
+    reader->savedCanvas = NULL;
+
+    return true;
+}
+
+#endif
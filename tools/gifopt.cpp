@@ -0,0 +1,217 @@
+//
+// gifopt.cpp
+// Public domain.
+//
+// Re-encodes an existing (animated) GIF through gif.h with its size-saving modes turned on:
+// frames cropped to the changed rectangle, palettes carried over from frame to frame,
+// and identical consecutive frames merged into one longer frame.
+// Reports the size before and after, and the time spent decoding and encoding.
+//
+// Build:  c++ -O2 -o gifopt gifopt.cpp
+// Usage:  gifopt [options] input.gif output.gif
+//
+// The input is composited onto an opaque canvas (gif.h writes no transparency of its own),
+// so areas a GIF leaves transparent come out black.
+//
+// Not addressed:
+// - gif.h writes the file header before it has seen a palette, so every frame still carries
+//   its own local color table, even when the palette is carried over unchanged.
+// - gif.h can only write an animation that loops forever, so a finite loop count in the input
+//   ("play 3 times") is lost; gifopt warns when that happens.
+//
+// If the input turns out to be damaged partway through, gifopt stops with an error and
+// removes the output rather than leaving a file with some of the frames missing.
+//
+
+#include "../gif.h"
+#include "../gif_read.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static long FileSize( const char* filename )
+{
+    FILE* f = fopen(filename, "rb");
+    if(!f) return -1;
+    fseek(f, 0, SEEK_END);
+    long len = ftell(f);
+    fclose(f);
+    return len;
+}
+
+static void Usage()
+{
+    fprintf(stderr,
+        "usage: gifopt [options] input.gif output.gif\n"
+        "  -b <bits>     palette bit depth, 2-8 (default: same as the input, at least 2)\n"
+        "  --dither      use Floyd-Steinberg dithering\n"
+        "  -t <steps>    treat pixels within this many steps per channel as unchanged (default 0)\n"
+        "  --no-crop     write every frame at full canvas size\n"
+        "  --no-reuse    build a fresh palette for every frame\n"
+        "  --no-merge    keep identical consecutive frames\n");
+}
+
+int main( int argc, char** argv )
+{
+    int bitDepth = 0;
+    int tolerance = 0;
+    bool dither = false;
+    bool crop = true, reuse = true, merge = true;
+    const char* inName = NULL;
+    const char* outName = NULL;
+
+    for(int ii=1; ii<argc; ++ii)
+    {
+        if(!strcmp(argv[ii], "-b") && ii+1 < argc) bitDepth = atoi(argv[++ii]);
+        else if(!strcmp(argv[ii], "-t") && ii+1 < argc) tolerance = atoi(argv[++ii]);
+        else if(!strcmp(argv[ii], "--dither")) dither = true;
+        else if(!strcmp(argv[ii], "--no-crop")) crop = false;
+        else if(!strcmp(argv[ii], "--no-reuse")) reuse = false;
+        else if(!strcmp(argv[ii], "--no-merge")) merge = false;
+        else if(!inName) inName = argv[ii];
+        else if(!outName) outName = argv[ii];
+        else { Usage(); return 1; }
+    }
+    if(!inName || !outName || bitDepth == 1 || bitDepth < 0 || bitDepth > 8 || tolerance < 0)
+    {
+        Usage();
+        return 1;
+    }
+
+    GifReader reader;
+    if(!GifReadBegin(&reader, inName))
+    {
+        fprintf(stderr, "gifopt: can't read %s\n", inName);
+        return 1;
+    }
+
+    const uint32_t width = reader.width, height = reader.height;
+    const size_t frameSize = (size_t)width*height*4;
+    uint8_t* canvas = (uint8_t*)calloc(frameSize, 1);
+
+    // the frame waiting to be written, held back in case the next ones are identical
+    uint8_t* pending = (uint8_t*)malloc(frameSize);
+    uint32_t pendingDelay = 0;
+    int pendingBits = 8;
+    bool havePending = false;
+
+    GifWriter writer;
+    writer.f = NULL;
+
+    int framesIn = 0, framesOut = 0;
+    bool failed = false;
+    clock_t decodeTime = 0, encodeTime = 0;
+
+    for(;;)
+    {
+        GifFrameInfo info;
+        clock_t start = clock();
+        bool more = GifReadFrame(&reader, canvas, &info);
+        decodeTime += clock() - start;
+
+        if(reader.error)
+        {
+            fprintf(stderr, "gifopt: %s is damaged after %d frames\n", inName, framesIn);
+            failed = true;
+            break;
+        }
+
+        uint32_t delay = more? info.delay : 0;
+
+        if(more)
+        {
+            ++framesIn;
+            if(havePending && merge && pendingDelay + delay <= 0xffff &&
+               !memcmp(pending, canvas, frameSize))
+            {
+                pendingDelay += delay;
+                continue;
+            }
+        }
+
+        start = clock();
+        if(havePending)
+        {
+            // GIF doesn't allow LZW codes of less than 2 bits, so 1-bit inputs go up to 2
+            int frameBits = bitDepth? bitDepth : GifIMax(pendingBits, 2);
+            if(!writer.f)
+            {
+                if(!GifBegin(&writer, outName, width, height, (reader.loopCount >= 0)? (pendingDelay? pendingDelay : 1) : 0, frameBits, dither))
+                {
+                    fprintf(stderr, "gifopt: can't write %s\n", outName);
+                    break;
+                }
+                if(reader.loopCount > 0)
+                    fprintf(stderr, "gifopt: warning: %s plays %d times, %s will loop forever\n", inName, reader.loopCount, outName);
+                writer.cropToChanges = crop;
+                writer.incrementalPalette = reuse;
+                writer.changeTolerance = tolerance;
+            }
+
+            GifWriteFrame(&writer, pending, width, height, pendingDelay, frameBits, dither);
+            ++framesOut;
+        }
+        encodeTime += clock() - start;
+
+        if(!more) break;
+
+        memcpy(pending, canvas, frameSize);
+        pendingDelay = delay;
+        pendingBits = GifIMax(info.bitDepth, 1);
+        havePending = true;
+    }
+
+    clock_t start = clock();
+    bool written = writer.f && GifEnd(&writer);
+    encodeTime += clock() - start;
+
+    free(pending);
+    GifReadEnd(&reader);
+
+    if(failed)
+    {
+        free(canvas);
+        if(written) remove(outName);
+        return 1;
+    }
+
+    if(!written)
+    {
+        free(canvas);
+        fprintf(stderr, "gifopt: no frames written\n");
+        return 1;
+    }
+
+    // make sure the output reads back before claiming anything about its size
+    int framesBack = 0;
+    bool readBack = false;
+    if(GifReadBegin(&reader, outName))
+    {
+        GifFrameInfo info;
+        memset(canvas, 0, frameSize);
+        while(GifReadFrame(&reader, canvas, &info)) ++framesBack;
+        readBack = !reader.error;
+        GifReadEnd(&reader);
+    }
+    free(canvas);
+
+    if(!readBack || framesBack != framesOut)
+    {
+        fprintf(stderr, "gifopt: %s doesn't read back (%d frames of %d)\n", outName, framesBack, framesOut);
+        remove(outName);
+        return 1;
+    }
+
+    long inSize = FileSize(inName);
+    long outSize = FileSize(outName);
+    printf("%s: %d frames, %ld bytes\n", inName, framesIn, inSize);
+    printf("%s: %d frames, %ld bytes (%.1f%%)\n", outName, framesOut, outSize, 100.0 * (double)outSize / (double)inSize);
+    printf("decode %.1f ms, encode %.1f ms (%.2f ms/frame)\n",
+        1000.0 * (double)decodeTime / CLOCKS_PER_SEC,
+        1000.0 * (double)encodeTime / CLOCKS_PER_SEC,
+        1000.0 * (double)encodeTime / CLOCKS_PER_SEC / GifIMax(framesOut, 1));
+
+    return 0;
+}